@@ -4,6 +4,8 @@
 #include <cppad/cppad.hpp>
 #include <eigen3/Eigen/Core>
 #include <map>
+#include <memory>
+#include <vector>
 
 #include "mpc_ipopt/helpers.h"
 
@@ -15,6 +17,13 @@
  * Call solve and get acceleration
  * Profit
  *
+ * Params can be changed between iterations with update_params.
+ * Weights, v_ref and limits are applied in place,
+ * changing forward.steps rebuilds the variable layout.
+ *
+ * Setting Params::robust.scenarios solves for a first step that is shared across
+ * all the given model scenarios instead of just the nominal model.
+ *
  * Intended to be use by mpc_local_planner
  *
  * Written for vehicle path planning task
@@ -43,6 +52,10 @@ namespace mpc_ipopt {
     template<typename T>
     struct LH {
         T low, high;
+
+        bool operator==(const LH &o) const { return low == o.low && high == o.high; }
+
+        bool operator!=(const LH &o) const { return !(*this == o); }
     };
 
     struct Params {
@@ -53,6 +66,10 @@ namespace mpc_ipopt {
 
         struct Limits {
             LH<double> vel, acc;
+
+            bool operator==(const Limits &o) const { return vel == o.vel && acc == o.acc; }
+
+            bool operator!=(const Limits &o) const { return !(*this == o); }
         } limits;
 
         // NOTE TODO: Params all have different scales
@@ -63,9 +80,36 @@ namespace mpc_ipopt {
 
         double v_ref;
         /*unsigned*/ double wheel_dist; // meters
+
+        // A perturbed copy of the model
+        struct Scenario {
+            double wheel_dist;      // meters
+            double slip_r, slip_l;  // Fraction of the commanded wheel velocity that is achieved
+
+            bool operator==(const Scenario &o) const {
+                return wheel_dist == o.wheel_dist && slip_r == o.slip_r && slip_l == o.slip_l;
+            }
+        };
+
+        // Robust mode, used when scenarios is not empty.
+        // Only the first step (a_r_0, a_l_0) is shared, each scenario gets its own remaining steps.
+        // Result::path is the path of the first scenario.
+        //
+        // NOTE: The first robust solve changes CppAD's global state for the whole process:
+        // - thread_alloc::parallel_setup, replacing any setup done by the application
+        // - thread_alloc::hold_memory(true), freed memory is kept in per thread pools instead of returned
+        // - parallel_ad<double>(), initialises CppAD's static AD<double> state for multi threading
+        // After that, solve must not be called concurrently on different MPC instances,
+        // as they share CppAD's per thread state.
+        struct Robust {
+            std::vector<Scenario> scenarios;
+            size_t threads;  // Scenarios are evaluated in parallel. 0 uses all cores
+        } robust;
     };
 
 
+    class RobustStructure;
+
     class MPC {
     public:
         // Diffrentiable vector of doubles
@@ -77,22 +121,26 @@ namespace mpc_ipopt {
 
 
         // Parameters
-        // TODO: Make editable with automatic indices reload.
-        const Params params;
-        const double dt; /* = 1 / params.forward.frequency */
-        const size_t &steps;
+        // Only changed through update_params
+        Params params;
+        double dt; /* = 1 / params.forward.frequency */
+        const size_t &steps; // = indices.steps
 
         std::string options; // TODO: Parameterize options
 
 
         // TODO: Better declaration format
         // Stores indices of variables and constraints
-        const class Indices {
+        // Reassigned when a rebuilt layout is swapped in
+        class Indices {
+        public:
+            size_t steps;
+
         private:
             // Variables
-            const size_t _a_r, _a_l;
+            size_t _a_r, _a_l;
         public:
-            const size_t vars_length;
+            size_t vars_length;
 
             [[nodiscard]] Range a_r(size_t offset = 0) const { return {0 + offset, _a_r}; }
 
@@ -100,9 +148,9 @@ namespace mpc_ipopt {
 
         private:
             // Constraints
-            const size_t _v_r, _v_l;
+            size_t _v_r, _v_l;
         public:
-            const size_t cons_length;
+            size_t cons_length;
 
             [[nodiscard]] Range v_r(size_t offset = 0) const { return {0 + offset, _v_r}; }
 
@@ -111,7 +159,8 @@ namespace mpc_ipopt {
             // Constructor
         public:
             explicit Indices(const size_t N) :
-            // Variables
+                    steps{N},
+                    // Variables
                     _a_r{N}, _a_l{_a_r + N},
                     vars_length{_a_l},
                     // Constraints
@@ -124,6 +173,12 @@ namespace mpc_ipopt {
         Dvector _vars;
         LH<Dvector> vars_b, cons_b;
 
+        // Reallocates indices, _vars and the bounds for the given number of steps
+        void set_layout(size_t steps);
+
+        // (Re)writes vars_b and cons_b from params.limits
+        void set_bounds();
+
         // TODO: move to helper.h
         // Wraps ADvector &outputs to access constraints easily.
         class ConsWrapper {
@@ -136,14 +191,56 @@ namespace mpc_ipopt {
             // const ADvector::value_type &operator[](size_t index) const { return _outputs[1 + index]; }
         };
 
-        // Calculates x,y,theta from velocity (stored in the constraints) and initial state.
+        // Evaluates the robust NLP, see robust.cpp
+        friend class RobustNLP;
+        friend class RobustStructure;
+
+        // Tapes and sparsity of the robust NLP, kept across solves while its structure does not change
+        std::shared_ptr<RobustStructure> robust_structure;
+
+        // Picks random initial variables, after a local infeasibility
+        void reseed();
+
+        // Nominal model, used by operator()
+        [[nodiscard]] Params::Scenario nominal() const { return {params.wheel_dist, 1, 1}; }
+
+        // Sets the cost function and calculates constraints from variables for a given scenario.
+        // Thread safe, only reads members.
+        void model(ADvector &outputs, const ADvector &vars, const Params::Scenario &scenario) const;
+
+        // Calculates x,y,theta from velocity (stored in the constraints) and initial state,
+        // with the same model as model() for the given scenario.
         // Store in the given vector
-        void get_states(const Dvector &cons, const State &initial, std::vector<State> &path_vector) const;
+        void get_states(const Dvector &cons, const State &initial, std::vector<State> &path_vector,
+                        const Params::Scenario &scenario) const;
 
     public:
 
         explicit MPC(Params p);
 
+        // How update_params applied a change. Later values are more expensive.
+        enum class Update {
+            none,       // Nothing changed
+            in_place,   // Weights, v_ref, wheel_dist, frequency or robust. Used from the next solve.
+            bounds,     // Limits. Bound vectors edited in place.
+            rebuild     // forward.steps. Indices, variables and bounds reallocated before returning.
+        };
+
+        // Applies new params without reallocating unless forward.steps changed.
+        // Call from the same thread as solve.
+        Update update_params(const Params &p);
+
+        [[nodiscard]] const Params &get_params() const { return params; }
+
+        // Layout and bounds in use by solve
+        [[nodiscard]] size_t layout_steps() const { return steps; }
+
+        [[nodiscard]] size_t vars_length() const { return indices.vars_length; }
+
+        [[nodiscard]] const LH<Dvector> &vars_bounds() const { return vars_b; }
+
+        [[nodiscard]] const LH<Dvector> &cons_bounds() const { return cons_b; }
+
         // These should be updated before calling solve
         State state;
         Dvector global_plan;
@@ -162,7 +259,11 @@ namespace mpc_ipopt {
         // TODO: take previous acceleration?
         bool solve(Result &result, bool get_path = false);
 
+    private:
+        // solve for when params.robust.scenarios is set
+        bool solve_robust(Result &result, bool get_path);
 
+    public:
         // Get erroname from error code (Result::status)
         const static std::map<size_t, std::string> error_string;
 
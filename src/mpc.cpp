@@ -10,7 +10,7 @@
 // We are implementing functions in the below namespace
 using namespace mpc_ipopt;
 
-MPC::MPC(Params p) : params(p), dt(1.0 / p.forward.frequency), steps(params.forward.steps),
+MPC::MPC(Params p) : params(p), dt(1.0 / p.forward.frequency), steps(indices.steps),
                      indices(params.forward.steps), state{} {
     assert(params.forward.steps > 1);
 
@@ -45,38 +45,81 @@ MPC::MPC(Params p) : params(p), dt(1.0 / p.forward.frequency), steps(params.forw
     // They are accessed through `cons`
 
 
-    // TODO: Allow dynamic configeration of variables, bounds, etc.
+    // Variables, bounds, etc. can be changed later through update_params
 
-    // Initialize variables
-    // Num_vars = [num_accelerations] * [num timesteps]
+    set_layout(params.forward.steps);
+}
 
+void MPC::set_layout(size_t steps) {
+    indices = Indices{steps};
 
+    // Initialize variables
+    // Num_vars = [num_accelerations] * [num timesteps]
     _vars = {indices.vars_length};
+    for (auto i : indices.a_r() + indices.a_l()) {
+        _vars[i] = pow(-1, i) * 0.01;
+    }
 
     vars_b = {{indices.vars_length},
               {indices.vars_length}};
+    cons_b = {{indices.cons_length},
+              {indices.cons_length}};
+    set_bounds();
+}
 
-    // _vars auto inited to 0
-    // Init bounds
+void MPC::set_bounds() {
+    // Variables:
+    // a_r, a_l
     for (auto i : indices.a_r() + indices.a_l()) {
-        _vars[i] = pow(-1, i) * 0.01;
-
         vars_b.low[i] = params.limits.acc.low;
         vars_b.high[i] = params.limits.acc.high;
     }
 
-
     // Constraints:
     // v_r, v_l
-    cons_b = {{indices.cons_length},
-              {indices.cons_length}};
-
     for (auto i : indices.v_r() + indices.v_l()) {
         cons_b.low[i] = params.limits.vel.low;
         cons_b.high[i] = params.limits.vel.high;
     }
 }
 
+MPC::Update MPC::update_params(const Params &p) {
+    assert(p.forward.steps > 1);
+
+    auto update = Update::none;
+
+    // These are only read in operator() / model(), which is taped again on every solve
+    const auto &w = params.wt;
+    if (w.acc != p.wt.acc || w.vel != p.wt.vel || w.omega != p.wt.omega ||
+        w.cte != p.wt.cte || w.etheta != p.wt.etheta ||
+        params.v_ref != p.v_ref || params.wheel_dist != p.wheel_dist ||
+        params.forward.frequency != p.forward.frequency ||
+        params.robust.scenarios != p.robust.scenarios || params.robust.threads != p.robust.threads) {
+        update = Update::in_place;
+    }
+
+    if (params.limits != p.limits) {
+        update = Update::bounds;
+    }
+
+    if (p.forward.steps != steps) {
+        update = Update::rebuild;
+    }
+
+    params = p;
+    dt = 1.0 / params.forward.frequency;
+
+    // Built here, on the solving thread. _vars and the bounds are CppAD::vectors,
+    // which allocate from CppAD's per thread pool and cannot be staged on another thread.
+    if (update == Update::rebuild) {
+        set_layout(params.forward.steps);
+    } else if (update == Update::bounds) {
+        set_bounds();
+    }
+
+    return update;
+}
+
 // Ignore warning
 const std::map<size_t, std::string> mpc_ipopt::MPC::error_string = {
         {0,  "not_defined"},
@@ -98,6 +141,9 @@ const std::map<size_t, std::string> mpc_ipopt::MPC::error_string = {
 
 
 bool MPC::solve(Result &result, bool get_path) {
+    if (!params.robust.scenarios.empty()) {
+        return solve_robust(result, get_path);
+    }
 
     CppAD::ipopt::solve_result<Dvector> solution;
 
@@ -112,25 +158,7 @@ bool MPC::solve(Result &result, bool get_path) {
         result.status = solution.status;
 
         if (solution.status == CppAD::ipopt::solve_result<Dvector>::local_infeasibility) {
-//            std::cout << "Choosing new vars.." << std::endl;
-            std::random_device rd{};
-            std::mt19937 gen{rd()};
-            std::normal_distribution<> d{0.1, 0.2};
-//            std::normal_distribution<> d{0.05, 0.1};
-
-            options = "";
-            // options += "Integer print_level  0\n"; // Disables all debug information
-            options += "String sb yes\n"; // Disables printing IPOPT creator banner
-            // TODO take as params
-            options += "Sparse  true        forward\n";
-            //options += "Sparse  true        reverse\n";
-            options += "Numeric max_cpu_time          0.5\n";
-
-            for (auto i : indices.a_r() + indices.a_l()) {
-                _vars[i] = d(gen);
-                std::cout << _vars[i] << ", ";
-            }
-            std::cout << std::endl;
+            reseed();
         }
 
         return false;
@@ -156,13 +184,17 @@ bool MPC::solve(Result &result, bool get_path) {
     result.acc.second = solution.x[indices.a_l()[0]];
 
     if (get_path) {
-        get_states(solution.g, state, result.path);
+        get_states(solution.g, state, result.path, nominal());
     }
 
     return true;
 }
 
 void MPC::operator()(ADvector &outputs, ADvector &vars) const {
+    model(outputs, vars, nominal());
+}
+
+void MPC::model(ADvector &outputs, const ADvector &vars, const Params::Scenario &scenario) const {
 //    const auto start = std::chrono::high_resolution_clock::now();  // ~0 ms
 
     auto &objective_func = outputs[0];
@@ -255,17 +287,21 @@ void MPC::operator()(ADvector &outputs, ADvector &vars) const {
         cons[*v_r_r] = prev.v_r + vars[*a_r_r] * dt;
         cons[*v_l_r] = prev.v_l + vars[*a_l_r] * dt;
 
+        // Velocities actually achieved by the wheels
+        // Constraints stay on the commanded velocities
+        const ADvector::value_type v_r = cons[*v_r_r] * scenario.slip_r, v_l = cons[*v_l_r] * scenario.slip_l;
+
         // Calculate state
-        x = prev.x + (cons[*v_r_r] + cons[*v_l_r]) * dt * CppAD::cos(prev.theta) / 2;
-        y = prev.y + (cons[*v_r_r] + cons[*v_l_r]) * dt * CppAD::sin(prev.theta) / 2;
-        theta = prev.theta + (cons[*v_r_r] - cons[*v_l_r]) * dt / params.wheel_dist;
+        x = prev.x + (v_r + v_l) * dt * CppAD::cos(prev.theta) / 2;
+        y = prev.y + (v_r + v_l) * dt * CppAD::sin(prev.theta) / 2;
+        theta = prev.theta + (v_r - v_l) * dt / scenario.wheel_dist;
 
 
         objective_func += params.wt.acc * CppAD::pow(vars[*a_r_r] + vars[*a_l_r], 2);
         // objective_func += params.wt.acc * CppAD::pow(vars[*a_r_r] - vars[*a_l_r], 2);
 
-        objective_func += params.wt.vel * CppAD::pow(cons[*v_r_r] + cons[*v_l_r] - 2 * params.v_ref, 2);
-        objective_func += params.wt.omega * CppAD::pow(cons[*v_r_r] - cons[*v_l_r], 2) / 2;// - 2 * params.v_ref, 2);
+        objective_func += params.wt.vel * CppAD::pow(v_r + v_l - 2 * params.v_ref, 2);
+        objective_func += params.wt.omega * CppAD::pow(v_r - v_l, 2) / 2;// - 2 * params.v_ref, 2);
 
         objective_func += params.wt.cte * CppAD::pow(polyeval(x, global_plan) - y, 2);
 
@@ -281,8 +317,31 @@ void MPC::operator()(ADvector &outputs, ADvector &vars) const {
 //            std::chrono::high_resolution_clock::now() - start).count() << "ms." << std::endl;  // ~0 ms
 }
 
+void MPC::reseed() {
+//    std::cout << "Choosing new vars.." << std::endl;
+    std::random_device rd{};
+    std::mt19937 gen{rd()};
+    std::normal_distribution<> d{0.1, 0.2};
+//    std::normal_distribution<> d{0.05, 0.1};
+
+    options = "";
+    // options += "Integer print_level  0\n"; // Disables all debug information
+    options += "String sb yes\n"; // Disables printing IPOPT creator banner
+    // TODO take as params
+    options += "Sparse  true        forward\n";
+    //options += "Sparse  true        reverse\n";
+    options += "Numeric max_cpu_time          0.5\n";
+
+    for (auto i : indices.a_r() + indices.a_l()) {
+        _vars[i] = d(gen);
+        std::cout << _vars[i] << ", ";
+    }
+    std::cout << std::endl;
+}
+
 // Parts of this function lifted from operator()
-void MPC::get_states(const Dvector &cons, const State &initial, std::vector<State> &path_vector) const {
+void MPC::get_states(const Dvector &cons, const State &initial, std::vector<State> &path_vector,
+                     const Params::Scenario &scenario) const {
     path_vector.clear();
     path_vector.reserve(steps + 1);
 
@@ -295,10 +354,13 @@ void MPC::get_states(const Dvector &cons, const State &initial, std::vector<Stat
     for (auto t : Range{0, steps}) {
         const auto &prev = path_vector.back();
 
+        // Achieved velocities, as in model()
+        const double v_r = cons[*v_r_r] * scenario.slip_r, v_l = cons[*v_l_r] * scenario.slip_l;
+
         State cur{
-                prev.x + (cons[*v_r_r] + cons[*v_l_r]) * dt * CppAD::cos(prev.theta) / 2,
-                prev.y + (cons[*v_r_r] + cons[*v_l_r]) * dt * CppAD::sin(prev.theta) / 2,
-                prev.theta + (cons[*v_r_r] - cons[*v_l_r]) * dt / params.wheel_dist,
+                prev.x + (v_r + v_l) * dt * CppAD::cos(prev.theta) / 2,
+                prev.y + (v_r + v_l) * dt * CppAD::sin(prev.theta) / 2,
+                prev.theta + (v_r - v_l) * dt / scenario.wheel_dist,
                 cons[*v_r_r],
                 cons[*v_l_r]
         };
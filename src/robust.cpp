@@ -0,0 +1,587 @@
+#include <iostream>
+#include <chrono>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <limits>
+#include <mutex>
+#include <set>
+#include <thread>
+
+#include <mpc_ipopt/mpc.h>
+
+#include <cppad/ipopt/solve_result.hpp>
+#include <coin/IpIpoptApplication.hpp>
+#include <coin/IpTNLP.hpp>
+
+// We are implementing functions in the below namespace
+using namespace mpc_ipopt;
+
+namespace {
+    /*
+     * Persistent worker threads registered with CppAD.
+     * CppAD keeps a tape and a memory pool per thread, found through thread_num(),
+     * so every thread that records or evaluates an ADFun needs its own number.
+     *
+     * Constructing it calls thread_alloc::parallel_setup, replacing any setup done by the application.
+     *
+     * The thread calling run is thread 0, workers are 1...size-1.
+     * Scenario s is always handled by thread s % threads, so its ADFun stays on one thread.
+     */
+    class Team {
+    public:
+        const size_t size;
+
+    private:
+        static thread_local size_t id;
+        static std::atomic<bool> parallel;
+
+        static bool in_parallel() { return parallel; }
+
+        static size_t thread_num() { return id; }
+
+        std::vector<std::thread> workers;
+        std::mutex run_mutex, mutex;
+        std::condition_variable start_cv, done_cv;
+
+        const std::function<void(size_t)> *job{nullptr};
+        size_t active{0}, remaining{0}, generation{0};
+        bool stop{false};
+
+        // Must be constructed in sequential mode
+        Team() : size(std::max<size_t>(1, std::min<size_t>(std::thread::hardware_concurrency(),
+                                                           CPPAD_MAX_NUM_THREADS))) {
+            CppAD::thread_alloc::parallel_setup(size, in_parallel, thread_num);
+            CppAD::thread_alloc::hold_memory(true);
+            CppAD::parallel_ad<double>();
+
+            for (auto i : Range{1, size}) {
+                workers.emplace_back(&Team::work, this, i);
+            }
+        }
+
+        void work(size_t i) {
+            id = i;
+            size_t seen = 0;
+
+            std::unique_lock<std::mutex> lock{mutex};
+            while (true) {
+                start_cv.wait(lock, [&] { return stop || generation != seen; });
+                if (stop) return;
+                seen = generation;
+
+                if (i < active) {
+                    const auto &f = *job;
+                    lock.unlock();
+                    f(i);
+                    lock.lock();
+
+                    if (--remaining == 0) done_cv.notify_one();
+                }
+            }
+        }
+
+    public:
+        static Team &get() {
+            static Team team;
+            return team;
+        }
+
+        ~Team() {
+            {
+                std::lock_guard<std::mutex> lock{mutex};
+                stop = true;
+            }
+            start_cv.notify_all();
+            for (auto &w : workers) w.join();
+        }
+
+        // Runs f(thread) for thread = 0...n-1 and waits for all of them.
+        // Callers are serialized, every caller is thread 0 to CppAD.
+        void run(size_t n, const std::function<void(size_t)> &f) {
+            std::lock_guard<std::mutex> running{run_mutex};
+
+            n = std::min(n, size);
+            if (n <= 1) {
+                f(0);
+                return;
+            }
+
+            {
+                std::lock_guard<std::mutex> lock{mutex};
+                job = &f;
+                active = n;
+                remaining = n - 1;
+                ++generation;
+                parallel = true;
+            }
+            start_cv.notify_all();
+
+            f(0);
+
+            std::unique_lock<std::mutex> lock{mutex};
+            done_cv.wait(lock, [&] { return remaining == 0; });
+            parallel = false;
+            job = nullptr;
+        }
+    };
+
+    thread_local size_t Team::id = 0;
+    std::atomic<bool> Team::parallel{false};
+}
+
+namespace mpc_ipopt {
+    /*
+     * Structure of the scenario tree NLP, with a shared first step.
+     *
+     * Each scenario s has its own copy of the nominal variables and constraints (laid out as MPC::Indices),
+     * and is taped into its own ADFun through MPC::model.
+     * Only a_r_0 and a_l_0 are shared, as that is the input actually applied.
+     * v_r_0 and v_l_0 only depend on them, so they are also shared instead of repeated per scenario,
+     * repeated rows would make the constraint jacobian rank deficient whenever they are active.
+     *
+     *  vars: [a_r_0, a_l_0 | s_0: a_r_1...a_r_N-1, a_l_1...a_l_N-1 | s_1: ... ]
+     *  cons: [v_r_0, v_l_0 | s_0: v_r_1...v_r_N-1, v_l_1...v_l_N-1 | s_1: ... ]
+     *
+     * The jacobian is block diagonal (plus the shared rows and columns) and the hessian of the lagrangian is
+     * block arrow shaped, so every scenario's blocks are evaluated independently on its own thread.
+     * Sparsity of each block and the index maps only depend on key(), so they are kept across solves.
+     * Every solve only records the tapes again, as the state and global plan are constants in them.
+     */
+    class RobustStructure {
+    public:
+        using Index = Ipopt::Index;
+        using Pattern = std::vector<std::set<size_t>>;
+
+        // Marks local entries that are not given to Ipopt
+        static constexpr size_t unused = std::numeric_limits<size_t>::max();
+
+        // One scenario. Created, used and freed only by thread s % threads.
+        struct Block {
+            CppAD::ADFun<double> fun;
+
+            // Structurally non zero entries of the jacobian of [objective, constraints...],
+            // and of the lower triangle of the hessian of any weighted sum of them
+            Pattern jac_pattern, hes_pattern;
+            std::vector<size_t> jac_row, jac_col, hes_row, hes_col;
+            CppAD::sparse_jacobian_work jac_work;
+            CppAD::sparse_hessian_work hes_work;
+
+            // Values at the current x
+            std::vector<double> y, jac, hes;
+        };
+
+        static size_t thread_count(const MPC &mpc) {
+            const auto &robust = mpc.params.robust;
+            const size_t team = Team::get().size;
+            return std::max<size_t>(1, std::min({robust.threads ? robust.threads : team,
+                                                 robust.scenarios.size(), team}));
+        }
+
+        // Everything the sparsity and index maps depend on.
+        // CppAD drops operations on parameters that are identically zero,
+        // so which of the constants in the tape are zero is part of it.
+        static std::vector<double> key(const MPC &mpc) {
+            const auto &p = mpc.params;
+            std::vector<double> k{double(thread_count(mpc)), double(mpc.steps), double(p.robust.scenarios.size()),
+                                  double(mpc.global_plan.size())};
+
+            const auto zero = [&](double v) { k.push_back(v == 0); };
+            for (auto v : {p.wt.acc, p.wt.vel, p.wt.omega, p.wt.cte, p.wt.etheta, p.v_ref, mpc.dt}) zero(v);
+            for (auto v : {mpc.state.x, mpc.state.y, mpc.state.theta, mpc.state.v_r, mpc.state.v_l}) zero(v);
+            for (auto i : Range{0, mpc.global_plan.size()}) zero(mpc.global_plan[i]);
+            for (const auto &s : p.robust.scenarios) {
+                zero(s.wheel_dist), zero(s.slip_r), zero(s.slip_l);
+            }
+            return k;
+        }
+
+        const std::vector<double> key_;
+
+        // Sizes of a single scenario
+        const size_t n_local, m_local;
+        // Local indices of the shared variables and constraints
+        const size_t a_r_0, a_l_0, v_r_0, v_l_0;
+
+        const size_t scenarios, threads;
+        const Index n, m;
+
+        // Local variable j of scenario s is variable var_map[s][j]
+        // Local constraint k of scenario s is constraint con_map[s][k]
+        std::vector<std::vector<Index>> var_map, con_map;
+
+        // Entry e of block s is given to Ipopt as entry jac_map[s][e] / hes_map[s][e] (lower triangle for hes)
+        std::vector<std::pair<Index, Index>> jac_entries, hes_entries;
+        std::vector<std::vector<size_t>> jac_map, hes_map;
+
+        std::vector<std::unique_ptr<Block>> blocks;
+
+        [[nodiscard]] bool shared_con(size_t k) const { return k == v_r_0 || k == v_l_0; }
+
+        // Tapes and finds the sparsity of every scenario, then builds the index maps
+        explicit RobustStructure(const MPC &mpc) :
+                key_(key(mpc)),
+                n_local(mpc.indices.vars_length), m_local(mpc.indices.cons_length),
+                a_r_0(mpc.indices.a_r()[0]), a_l_0(mpc.indices.a_l()[0]),
+                v_r_0(mpc.indices.v_r()[0]), v_l_0(mpc.indices.v_l()[0]),
+                scenarios(mpc.params.robust.scenarios.size()), threads(thread_count(mpc)),
+                n(2 + scenarios * (n_local - 2)), m(2 + scenarios * (m_local - 2)),
+                var_map(scenarios), con_map(scenarios),
+                jac_map(scenarios), hes_map(scenarios), blocks(scenarios) {
+
+            Index next_var = 2, next_con = 2;
+            for (auto s : Range{0, scenarios}) {
+                var_map[s].resize(n_local);
+                for (auto j : Range{0, n_local}) {
+                    var_map[s][j] = j == a_r_0 ? 0 : j == a_l_0 ? 1 : next_var++;
+                }
+
+                con_map[s].resize(m_local);
+                for (auto k : Range{0, m_local}) {
+                    con_map[s][k] = k == v_r_0 ? 0 : k == v_l_0 ? 1 : next_con++;
+                }
+            }
+
+            // Tape every scenario on the thread that will evaluate it
+            Team::get().run(threads, [&](size_t t) {
+                for (size_t s = t; s < scenarios; s += threads) {
+                    blocks[s] = std::make_unique<Block>();
+                    tape(mpc, s);
+                    sparsity(*blocks[s]);
+                }
+            });
+
+            for (auto s : Range{0, scenarios}) {
+                const auto &b = *blocks[s];
+
+                // Row 0 is the objective, and the shared rows are only given for the first scenario
+                for (auto e : Range{0, b.jac_row.size()}) {
+                    const size_t r = b.jac_row[e];
+                    if (r == 0 || (s > 0 && shared_con(r - 1))) {
+                        jac_map[s].push_back(unused);
+                    } else {
+                        jac_map[s].push_back(jac_entries.size());
+                        jac_entries.emplace_back(con_map[s][r - 1], var_map[s][b.jac_col[e]]);
+                    }
+                }
+            }
+
+            // Only the shared entries coincide between scenarios
+            std::map<std::pair<Index, Index>, size_t> entry_index;
+            for (auto s : Range{0, scenarios}) {
+                const auto &b = *blocks[s];
+                for (auto e : Range{0, b.hes_row.size()}) {
+                    const auto gi = var_map[s][b.hes_row[e]], gj = var_map[s][b.hes_col[e]];
+                    const auto entry = entry_index.emplace(std::make_pair(std::max(gi, gj), std::min(gi, gj)),
+                                                           hes_entries.size());
+                    if (entry.second) hes_entries.push_back(entry.first->first);
+                    hes_map[s].push_back(entry.first->second);
+                }
+            }
+        }
+
+        ~RobustStructure() {
+            // Free every tape on the thread that allocated it
+            Team::get().run(threads, [&](size_t t) {
+                for (size_t s = t; s < scenarios; s += threads) blocks[s].reset();
+            });
+        }
+
+        // Records every scenario again, with the current state and global plan
+        void retape(const MPC &mpc) {
+            Team::get().run(threads, [&](size_t t) {
+                for (size_t s = t; s < scenarios; s += threads) tape(mpc, s);
+            });
+        }
+
+        [[nodiscard]] std::vector<double> local(size_t s, const Ipopt::Number *x) const {
+            std::vector<double> xs(n_local);
+            for (auto j : Range{0, n_local}) xs[j] = x[var_map[s][j]];
+            return xs;
+        }
+
+    private:
+        void tape(const MPC &mpc, size_t s) {
+            auto &b = *blocks[s];
+
+            MPC::ADvector vars{n_local}, outputs{1 + m_local};
+            for (auto j : Range{0, n_local}) vars[j] = mpc._vars[j];
+
+            CppAD::Independent(vars);
+            mpc.model(outputs, vars, mpc.params.robust.scenarios[s]);
+            b.fun.Dependent(vars, outputs);
+        }
+
+        void sparsity(Block &b) const {
+            Pattern identity(n_local);
+            for (auto j : Range{0, n_local}) identity[j].insert(j);
+            b.jac_pattern = b.fun.ForSparseJac(n_local, identity);
+
+            Pattern all(1);
+            for (auto k : Range{0, 1 + m_local}) all[0].insert(k);
+            b.hes_pattern = b.fun.RevSparseHes(n_local, all);
+
+            for (auto r : Range{0, 1 + m_local}) {
+                for (auto c : b.jac_pattern[r]) {
+                    b.jac_row.push_back(r);
+                    b.jac_col.push_back(c);
+                }
+            }
+            for (auto i : Range{0, n_local}) {
+                for (auto j : b.hes_pattern[i]) {
+                    if (j > i) continue;
+                    b.hes_row.push_back(i);
+                    b.hes_col.push_back(j);
+                }
+            }
+
+            b.jac.resize(b.jac_row.size());
+            b.hes.resize(b.hes_row.size());
+        }
+    };
+
+    /*
+     * Ipopt view of a RobustStructure for a single solve.
+     * The objective is the mean of the scenario costs.
+     * Contributions to the shared entries are summed on the calling thread.
+     */
+    class RobustNLP : public Ipopt::TNLP {
+        using Index = Ipopt::Index;
+        using Number = Ipopt::Number;
+
+        RobustStructure &st;
+        const MPC &mpc;
+        // Ipopt is stopped at the first iteration past this
+        const std::chrono::steady_clock::time_point deadline;
+        bool evaluated{false};
+
+        // Function values and jacobians of all scenarios
+        void evaluate(const Number *x_, bool new_x) {
+            if (evaluated && !new_x) return;
+
+            Team::get().run(st.threads, [&](size_t t) {
+                for (size_t s = t; s < st.scenarios; s += st.threads) {
+                    auto &b = *st.blocks[s];
+                    const auto xs = st.local(s, x_);
+                    b.y = b.fun.Forward(0, xs);
+                    b.fun.SparseJacobianForward(xs, b.jac_pattern, b.jac_row, b.jac_col, b.jac, b.jac_work);
+                }
+            });
+            evaluated = true;
+        }
+
+    public:
+        // Filled by finalize_solution
+        size_t status{CppAD::ipopt::solve_result<Dvector>::not_defined};
+        std::vector<double> x;
+        // Constraints of the first scenario, laid out as MPC::Indices
+        std::vector<double> cons_0;
+
+        RobustNLP(RobustStructure &st, const MPC &mpc, std::chrono::steady_clock::time_point deadline) :
+                st(st), mpc(mpc), deadline(deadline) {}
+
+        bool get_nlp_info(Index &n, Index &m, Index &nnz_jac_g, Index &nnz_h_lag,
+                          IndexStyleEnum &index_style) override {
+            n = st.n;
+            m = st.m;
+            nnz_jac_g = st.jac_entries.size();
+            nnz_h_lag = st.hes_entries.size();
+            index_style = C_STYLE;
+            return true;
+        }
+
+        bool get_bounds_info(Index n, Number *x_l, Number *x_u, Index m, Number *g_l, Number *g_u) override {
+            const auto &limits = mpc.params.limits;
+            std::fill(x_l, x_l + n, limits.acc.low);
+            std::fill(x_u, x_u + n, limits.acc.high);
+            std::fill(g_l, g_l + m, limits.vel.low);
+            std::fill(g_u, g_u + m, limits.vel.high);
+            return true;
+        }
+
+        bool get_starting_point(Index, bool init_x, Number *x_, bool init_z, Number *, Number *,
+                                Index, bool init_lambda, Number *) override {
+            assert(init_x && !init_z && !init_lambda);
+            for (auto s : Range{0, st.scenarios}) {
+                for (auto j : Range{0, st.n_local}) x_[st.var_map[s][j]] = mpc._vars[j];
+            }
+            return true;
+        }
+
+        bool eval_f(Index, const Number *x_, bool new_x, Number &obj_value) override {
+            evaluate(x_, new_x);
+            obj_value = 0;
+            for (const auto &b : st.blocks) obj_value += b->y[0];
+            obj_value /= st.scenarios;
+            return true;
+        }
+
+        bool eval_grad_f(Index n, const Number *x_, bool new_x, Number *grad_f) override {
+            evaluate(x_, new_x);
+            std::fill(grad_f, grad_f + n, 0);
+            // Row 0 of the jacobian is the objective
+            for (auto s : Range{0, st.scenarios}) {
+                const auto &b = *st.blocks[s];
+                for (auto e : Range{0, b.jac_row.size()}) {
+                    if (b.jac_row[e] == 0) grad_f[st.var_map[s][b.jac_col[e]]] += b.jac[e] / st.scenarios;
+                }
+            }
+            return true;
+        }
+
+        bool eval_g(Index, const Number *x_, bool new_x, Index, Number *g_) override {
+            evaluate(x_, new_x);
+            // Shared rows are written by every scenario, with the same value
+            for (auto s : Range{0, st.scenarios}) {
+                for (auto k : Range{0, st.m_local}) g_[st.con_map[s][k]] = st.blocks[s]->y[1 + k];
+            }
+            return true;
+        }
+
+        bool eval_jac_g(Index, const Number *x_, bool new_x, Index, Index, Index *iRow, Index *jCol,
+                        Number *values) override {
+            if (values == nullptr) {
+                for (auto e : Range{0, st.jac_entries.size()}) {
+                    iRow[e] = st.jac_entries[e].first;
+                    jCol[e] = st.jac_entries[e].second;
+                }
+                return true;
+            }
+
+            evaluate(x_, new_x);
+            for (auto s : Range{0, st.scenarios}) {
+                const auto &b = *st.blocks[s];
+                for (auto e : Range{0, b.jac_row.size()}) {
+                    if (st.jac_map[s][e] != RobustStructure::unused) values[st.jac_map[s][e]] = b.jac[e];
+                }
+            }
+            return true;
+        }
+
+        bool eval_h(Index, const Number *x_, bool new_x, Number obj_factor, Index, const Number *lambda,
+                    bool, Index nele_hess, Index *iRow, Index *jCol, Number *values) override {
+            if (values == nullptr) {
+                for (auto e : Range{0, st.hes_entries.size()}) {
+                    iRow[e] = st.hes_entries[e].first;
+                    jCol[e] = st.hes_entries[e].second;
+                }
+                return true;
+            }
+
+            if (new_x) evaluated = false;
+
+            Team::get().run(st.threads, [&](size_t t) {
+                for (size_t s = t; s < st.scenarios; s += st.threads) {
+                    auto &b = *st.blocks[s];
+                    if (b.hes_row.empty()) continue;
+
+                    // Weights of [objective, constraints...]. Shared rows are counted once, in the first scenario
+                    std::vector<double> w(1 + st.m_local);
+                    w[0] = obj_factor / st.scenarios;
+                    for (auto k : Range{0, st.m_local}) {
+                        w[1 + k] = s > 0 && st.shared_con(k) ? 0 : lambda[st.con_map[s][k]];
+                    }
+
+                    b.fun.SparseHessian(st.local(s, x_), w, b.hes_pattern, b.hes_row, b.hes_col, b.hes, b.hes_work);
+                }
+            });
+
+            std::fill(values, values + nele_hess, 0);
+            for (auto s : Range{0, st.scenarios}) {
+                const auto &b = *st.blocks[s];
+                for (auto e : Range{0, b.hes_row.size()}) values[st.hes_map[s][e]] += b.hes[e];
+            }
+            return true;
+        }
+
+        // Wall clock limit. max_cpu_time counts every thread of the process, and Ipopt 3.12 has no max_wall_time.
+        // Returning false stops Ipopt with USER_REQUESTED_STOP.
+        bool intermediate_callback(Ipopt::AlgorithmMode, Index, Number, Number, Number, Number, Number, Number,
+                                   Number, Number, Index, const Ipopt::IpoptData *,
+                                   Ipopt::IpoptCalculatedQuantities *) override {
+            return std::chrono::steady_clock::now() < deadline;
+        }
+
+        void finalize_solution(Ipopt::SolverReturn solver_status, Index n, const Number *x_, const Number *,
+                               const Number *, Index, const Number *g_, const Number *, Number,
+                               const Ipopt::IpoptData *, Ipopt::IpoptCalculatedQuantities *) override {
+            // Same codes as CppAD::ipopt::solve, see MPC::error_string
+            using result = CppAD::ipopt::solve_result<Dvector>;
+            switch (solver_status) {
+                case Ipopt::SUCCESS: status = result::success; break;
+                case Ipopt::MAXITER_EXCEEDED: status = result::maxiter_exceeded; break;
+                case Ipopt::STOP_AT_TINY_STEP: status = result::stop_at_tiny_step; break;
+                case Ipopt::STOP_AT_ACCEPTABLE_POINT: status = result::stop_at_acceptable_point; break;
+                case Ipopt::LOCAL_INFEASIBILITY: status = result::local_infeasibility; break;
+                case Ipopt::USER_REQUESTED_STOP: status = result::user_requested_stop; break;
+                case Ipopt::FEASIBLE_POINT_FOUND: status = result::feasible_point_found; break;
+                case Ipopt::DIVERGING_ITERATES: status = result::diverging_iterates; break;
+                case Ipopt::RESTORATION_FAILURE: status = result::restoration_failure; break;
+                case Ipopt::ERROR_IN_STEP_COMPUTATION: status = result::error_in_step_computation; break;
+                case Ipopt::INVALID_NUMBER_DETECTED: status = result::invalid_number_detected; break;
+                case Ipopt::TOO_FEW_DEGREES_OF_FREEDOM: status = result::too_few_degrees_of_freedom; break;
+                case Ipopt::INTERNAL_ERROR: status = result::internal_error; break;
+                default: status = result::unknown;
+            }
+
+            x.assign(x_, x_ + n);
+
+            cons_0.resize(st.m_local);
+            for (auto k : Range{0, st.m_local}) cons_0[k] = g_[st.con_map[0][k]];
+        }
+    };
+}
+
+bool MPC::solve_robust(Result &result, bool get_path) {
+    const auto start = std::chrono::high_resolution_clock::now();
+    // Same budget as max_cpu_time of the nominal solve, but in wall time
+    const auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(500);
+
+    if (robust_structure && robust_structure->key_ == RobustStructure::key(*this)) {
+        robust_structure->retape(*this);
+    } else {
+        robust_structure.reset(); // Free the old tapes first
+        robust_structure = std::make_shared<RobustStructure>(*this);
+    }
+
+    // SmartPtr owns it, keep a raw pointer for the solution
+    auto *robust = new RobustNLP(*robust_structure, *this, deadline);
+    Ipopt::SmartPtr<Ipopt::TNLP> nlp = robust;
+
+    Ipopt::SmartPtr<Ipopt::IpoptApplication> app = IpoptApplicationFactory();
+    app->Options()->SetIntegerValue("print_level", 0); // Disables all debug information
+    app->Options()->SetStringValue("sb", "yes"); // Disables printing IPOPT creator banner
+
+    if (app->Initialize() != Ipopt::Solve_Succeeded) {
+        result.status = CppAD::ipopt::solve_result<Dvector>::internal_error;
+        return false;
+    }
+    app->OptimizeTNLP(nlp);
+
+    std::cout << "IPOPT (" << params.robust.scenarios.size() << " scenarios) "
+              << std::chrono::duration_cast<std::chrono::milliseconds>(
+                      std::chrono::high_resolution_clock::now() - start).count() << "ms." << std::endl;
+
+    result.status = robust->status;
+    if (robust->status != CppAD::ipopt::solve_result<Dvector>::success) {
+        if (robust->status == CppAD::ipopt::solve_result<Dvector>::local_infeasibility) {
+            reseed();
+        }
+        return false;
+    }
+
+    // The shared first step
+    result.acc.first = robust->x[0];
+    result.acc.second = robust->x[1];
+
+    if (get_path) {
+        // Path of the first scenario, with its own model
+        Dvector cons{indices.cons_length};
+        for (auto k : Range{0, indices.cons_length}) cons[k] = robust->cons_0[k];
+        get_states(cons, state, result.path, params.robust.scenarios[0]);
+    }
+
+    return true;
+}
@@ -1,26 +1,158 @@
 #include <mpc_ipopt/mpc.h>
+#include <chrono>
+#include <cmath>
 #include <iostream>
 
+namespace {
+    int failures = 0;
+
+    void check(bool ok, const std::string &what) {
+        if (!ok) {
+            ++failures;
+            std::cerr << "FAILED: " << what << std::endl;
+        }
+    }
+
+    mpc_ipopt::Params make_params() {
+        mpc_ipopt::Params p{};
+        p.forward.steps = 20;
+        p.forward.frequency = 20;
+        p.limits.vel = {-1, 1};
+        p.limits.acc = {-0.1, 0.1};
+        p.wheel_dist = 0.65; //meters
+        p.v_ref = 1;
+        p.wt = {100, 200, 400};
+        return p;
+    }
+
+    void setup(mpc_ipopt::MPC &mpc) {
+        mpc_ipopt::Dvector vec{2};
+        vec[0] = -0.5;
+        vec[1] = 1;
+        mpc.global_plan = vec;
+        mpc.state.v_r = 0.3;
+        mpc.state.v_l = 0.7;
+    }
+
+    void test_update_params() {
+        using Update = mpc_ipopt::MPC::Update;
+
+        mpc_ipopt::MPC mpc(make_params());
+        setup(mpc);
+        mpc_ipopt::MPC::Result res;
+
+        auto p = mpc.get_params();
+        check(mpc.update_params(p) == Update::none, "same params is none");
+
+        p.wt.acc = 2;
+        p.v_ref = 0.5;
+        check(mpc.update_params(p) == Update::in_place, "weights and v_ref are in place");
+
+        // Bounds are edited, not reallocated
+        const double *low = &mpc.vars_bounds().low[0];
+        p.limits.acc = {-0.2, 0.2};
+        p.limits.vel = {-0.5, 0.5};
+        check(mpc.update_params(p) == Update::bounds, "limits are bounds");
+        check(&mpc.vars_bounds().low[0] == low, "bounds edited in place");
+        check(mpc.vars_bounds().high[mpc.vars_length() - 1] == 0.2, "acc limit applied");
+        check(mpc.cons_bounds().low[0] == -0.5, "vel limit applied");
+
+        // Rebuild is done before update_params returns
+        p.forward.steps = 30;
+        check(mpc.update_params(p) == Update::rebuild, "steps is rebuild");
+        check(mpc.layout_steps() == 30 && mpc.vars_length() == 60, "new layout in use");
+        check(mpc.vars_bounds().low[59] == -0.2 && mpc.cons_bounds().high[59] == 0.5, "bounds kept on new layout");
+
+        auto q = mpc.get_params();
+        check(q.forward.steps == 30, "get_params reports new steps");
+        q.wt.vel = 300;
+        check(mpc.update_params(q) == Update::in_place, "read-modify-write keeps the layout");
+        check(mpc.layout_steps() == 30, "layout unchanged by read-modify-write");
+
+        check(mpc.solve(res), "solve on new layout");
+    }
+
+    bool close(const std::pair<double, double> &a, const std::pair<double, double> &b, double tol) {
+        return std::abs(a.first - b.first) < tol && std::abs(a.second - b.second) < tol;
+    }
+
+    // Solves with the given scenarios and threads
+    bool solve_robust(const std::vector<mpc_ipopt::Params::Scenario> &scenarios, size_t threads,
+                      mpc_ipopt::MPC::Result &res) {
+        auto p = make_params();
+        p.robust.scenarios = scenarios;
+        p.robust.threads = threads;
+
+        mpc_ipopt::MPC mpc(p);
+        setup(mpc);
+        return mpc.solve(res, true);
+    }
+
+    void test_robust() {
+        const auto p = make_params();
+        const mpc_ipopt::Params::Scenario nominal{p.wheel_dist, 1, 1};
+
+        mpc_ipopt::MPC mpc(p);
+        setup(mpc);
+        mpc_ipopt::MPC::Result expected;
+        check(mpc.solve(expected), "nominal solve");
+
+        // A single nominal scenario is the nominal problem
+        mpc_ipopt::MPC::Result res;
+        check(solve_robust({nominal}, 1, res), "single scenario solve");
+        check(close(res.acc, expected.acc, 1e-4), "single nominal scenario matches nominal");
+        check(res.path.size() == p.forward.steps + 1, "single scenario path");
+
+        // Copies of the nominal scenario only duplicate the tails, the optimum is the same
+        check(solve_robust(std::vector<mpc_ipopt::Params::Scenario>(4, nominal), 4, res), "copies solve");
+        check(close(res.acc, expected.acc, 1e-4), "nominal copies match nominal");
+
+        // Perturbed scenarios. Thread count must not change the result
+        const std::vector<mpc_ipopt::Params::Scenario> scenarios{
+                nominal, {0.6, 0.9, 1}, {0.7, 1, 0.9}, {0.65, 0.85, 0.85}, {0.55, 1, 1}};
+        mpc_ipopt::MPC::Result serial, parallel;
+        check(solve_robust(scenarios, 1, serial), "perturbed serial solve");
+        check(solve_robust(scenarios, 4, parallel), "perturbed parallel solve");
+        check(close(serial.acc, parallel.acc, 1e-9), "threads do not change the result");
+        check(std::abs(parallel.acc.first) <= p.limits.acc.high + 1e-6 &&
+              std::abs(parallel.acc.second) <= p.limits.acc.high + 1e-6, "shared step within limits");
+
+        // Repeated ticks reuse the cached structure and only retape
+        auto q = make_params();
+        q.robust.scenarios = scenarios;
+        mpc_ipopt::MPC mpc_ticks(q);
+        setup(mpc_ticks);
+
+        const int ticks = 10;
+        const auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < ticks; ++i) {
+            check(mpc_ticks.solve(res), "robust tick solve");
+            check(close(res.acc, parallel.acc, 1e-9), "robust tick matches first solve");
+        }
+        std::cout << "Robust tick (" << scenarios.size() << " scenarios): "
+                  << std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() / ticks
+                  << "ms" << std::endl;
+
+        // Changing the state keeps the structure, changing the plan's length rebuilds it
+        mpc_ticks.state.v_r = 0.4;
+        check(mpc_ticks.solve(res), "robust solve after state change");
+        mpc_ipopt::Dvector plan{3};
+        plan[0] = -0.5, plan[1] = 1, plan[2] = 0.1;
+        mpc_ticks.global_plan = plan;
+        check(mpc_ticks.solve(res), "robust solve after plan change");
+    }
+}
+
 int main() {
-    mpc_ipopt::Params p{};
-    p.forward.steps = 20;
-    p.forward.frequency = 20;
-    p.limits.vel = {-1, 1};
-    p.limits.acc = {-0.1, 0.1};
-    p.wheel_dist = 0.65; //meters
-    p.v_ref = 1;
-    p.wt = {100, 200, 400};
-
-    mpc_ipopt::MPC mpc(p);
-
-    mpc_ipopt::Dvector vec{2};
-    vec[0] = -0.5;
-    vec[1] = 1;
-    mpc.global_plan = vec;
-    mpc.state.v_r = 0.3;
-    mpc.state.v_l = 0.7;
+    mpc_ipopt::MPC mpc(make_params());
+    setup(mpc);
 
     mpc_ipopt::MPC::Result res;
     mpc.solve(res, false);
-    return 0;
-}
\ No newline at end of file
+
+    test_update_params();
+    test_robust();
+
+    std::cout << (failures ? "FAILED" : "PASSED") << std::endl;
+    return failures != 0;
+}